@@ -1,8 +1,17 @@
 #include "xdk/jude/do.h"
 
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <exception>
 #include <iostream>
 #include <string>
+#include <utility>
+#include <vector>
 
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "xdk/jude/lexer.h"
 #include "xdk/jude/reader.h"
 #include "xdk/lua/back.h"
 #include "xdk/lua/sandbox.h"
@@ -11,35 +20,126 @@ namespace xdk {
 namespace {
 constexpr char kUnnamed[] = "_";
 
+// Pushes a new userdata holding where _o outputs to, and returns it. It is
+// reset to nullptr once rendering is done, so that an _o kept by the template
+// cannot output to a destroyed RenderResult.
+jude::RenderResult **newbox(lua_State *L) {
+  auto **box = static_cast<jude::RenderResult **>(
+      lua_newuserdata(L, sizeof(jude::RenderResult *)));
+  *box = nullptr;
+  return box;
+}
+
+// Returns the block of result with the given name, creating it if needed, or
+// nullptr if out of memory. Exceptions must not go through Lua frames.
+std::string *mutableblock(jude::RenderResult *result,
+                          absl::string_view name) noexcept {
+  try {
+    return result->MutableBlock(name);
+  } catch (const std::exception &) {
+    return nullptr;
+  }
+}
+
+// Appends data to block. Returns false if out of memory.
+bool append(std::string *block, const char *data, size_t size) noexcept {
+  try {
+    block->append(data, size);
+  } catch (const std::exception &) {
+    return false;
+  }
+  return true;
+}
+
+// Appends the number at index to block, formatted like lua_tolstring() does
+// but without creating a Lua string. Returns false if out of memory.
+bool appendnumber(lua_State *L, int index, std::string *block) noexcept {
+  char buffer[64];
+  int size;
+#if LUA_VERSION_NUM >= 503
+  if (lua_isinteger(L, index)) {
+    size = std::snprintf(buffer, sizeof(buffer), LUA_INTEGER_FMT,
+                         static_cast<LUAI_UACINT>(lua_tointeger(L, index)));
+    return append(block, buffer, size);
+  }
+#endif
+  size = std::snprintf(buffer, sizeof(buffer), LUA_NUMBER_FMT,
+                       static_cast<LUAI_UACNUMBER>(lua_tonumber(L, index)));
+#if LUA_VERSION_NUM >= 503
+  // Like Lua, tell floats looking like integers apart with a ".0".
+  if (buffer[std::strspn(buffer, "-0123456789")] == '\0') {
+    buffer[size++] = lua_getlocaledecpoint();
+    buffer[size++] = '0';
+  }
+#endif
+  return append(block, buffer, size);
+}
+
+int outofmemory(lua_State *L) {
+  lua_pushliteral(L, "not enough memory");
+  return lua_error(L);
+}
+
+// Appends its arguments to the current block of the RenderResult boxed in
+// upvalue 1. Upvalue 2 is the stack of block names.
 int _o(lua_State *L) {
-  // Get current block name.
-  lua::getback(L, lua_upvalueindex(2));
-  if (lua_isnil(L, -1)) {
-    lua_pop(L, 1);
-    lua_pushstring(L, kUnnamed);
+  auto **box = static_cast<jude::RenderResult **>(
+      lua_touserdata(L, lua_upvalueindex(1)));
+  jude::RenderResult *result = *box;
+  if (result == nullptr) {
+    lua_pushliteral(L, "_o() called outside of a render");
+    return lua_error(L);
   }
-  // Get value of that block and push it before any argument
-  // with which o_ was invoked.
-  lua_rawget(L, lua_upvalueindex(1));
-  lua_insert(L, 1);
-  // Convert nil values to empty string.
-  for (int index = 1; index <= lua_gettop(L); ++index) {
-    if (lua_isnil(L, index)) {
-      lua_pushstring(L, "");
-      lua_replace(L, index);
-    }
-  }
-  // Use concat to support arguments with a __concat metamethod.
-  lua_pushstring(L, "");
-  lua_concat(L, lua_gettop(L));
-  // Get current block name and save result to that block.
+  const int top = lua_gettop(L);
+  // Get current block name, and keep it on the stack.
   lua::getback(L, lua_upvalueindex(2));
   if (lua_isnil(L, -1)) {
     lua_pop(L, 1);
     lua_pushstring(L, kUnnamed);
   }
-  lua_insert(L, -2);
-  lua_rawset(L, lua_upvalueindex(1));
+  size_t size;
+  const char *data = lua_tolstring(L, -1, &size);
+  if (data == nullptr) {
+    lua_pushliteral(L, "block name must be a string");
+    return lua_error(L);
+  }
+  const absl::string_view name(data, size);
+  std::string *block = mutableblock(result, name);
+  if (block == nullptr) {
+    return outofmemory(L);
+  }
+  for (int index = 1; index <= top; ++index) {
+    bool appended = true;
+    switch (lua_type(L, index)) {
+    case LUA_TNIL:
+      break;
+    case LUA_TSTRING:
+      data = lua_tolstring(L, index, &size);
+      appended = append(block, data, size);
+      break;
+    case LUA_TNUMBER:
+      appended = appendnumber(L, index, block);
+      break;
+    default:
+      // Use concat to support arguments with a __concat metamethod, which
+      // gets the argument first like for `value .. ""`.
+      lua_pushvalue(L, index);
+      lua_pushliteral(L, "");
+      lua_concat(L, 2);
+      data = lua_tolstring(L, -1, &size);
+      if (data == nullptr) {
+        lua_pushliteral(L, "concatenation must give a string");
+        return lua_error(L);
+      }
+      // The metamethod may have output to other blocks, invalidating block.
+      block = mutableblock(result, name);
+      appended = block != nullptr && append(block, data, size);
+      lua_pop(L, 1);
+    }
+    if (!appended) {
+      return outofmemory(L);
+    }
+  }
   return 0;
 }
 
@@ -49,6 +149,11 @@ int beginblock(lua_State *L) {
                     lua_gettop(L));
     return lua_error(L);
   }
+  if (!lua_isstring(L, 1)) {
+    lua_pushfstring(L, "beginblock() expects a string, got %s",
+                    lua_typename(L, lua_type(L, 1)));
+    return lua_error(L);
+  }
   lua::pushback(L, lua_upvalueindex(1));
   return 0;
 }
@@ -62,50 +167,701 @@ int endblock(lua_State *L) {
   return 0;
 }
 
-} // namespace
+// __newindex of the environment in which specialize() evaluates code, and of
+// views of its tables. Code changing the static context has side effects, so
+// it must not be evaluated ahead.
+int readonly(lua_State *L) {
+  lua_pushliteral(L, "static context is read-only");
+  return lua_error(L);
+}
 
-namespace jude {
+void pushview(lua_State *L, int index, int cache);
 
-int dostring(lua_State *L, const char *data, size_t size,
-             const char *name) noexcept {
-  lua_newtable(L); // BLOCKS
-  lua_newtable(L); // BLOCKS STACK
+// __index of a view. Upvalue 1 is the viewed table, upvalue 2 the view cache.
+int viewindex(lua_State *L) {
+  lua_pushvalue(L, 2);
+  lua_gettable(L, lua_upvalueindex(1));
+  pushview(L, -1, lua_upvalueindex(2));
+  return 1;
+}
 
-  Reader reader(data, size);
-  if (int error = lua_load(L, Reader::Read, &reader, name, "t")) {
-    lua_remove(L, -3); // BLOCKS
-    lua_remove(L, -2); // BLOCKS STACK
-    return error;
+// __len of a view. Upvalue 1 is the viewed table.
+int viewlen(lua_State *L) {
+  lua_len(L, lua_upvalueindex(1));
+  return 1;
+}
+
+// Iterator over a view. Upvalue 1 is the viewed table, upvalue 2 the view
+// cache.
+int viewnext(lua_State *L) {
+  lua_settop(L, 2);
+  if (!lua_next(L, lua_upvalueindex(1))) {
+    lua_pushnil(L);
+    return 1;
+  }
+  pushview(L, -1, lua_upvalueindex(2));
+  lua_remove(L, -2);
+  return 2;
+}
+
+// __pairs of a view. Upvalue 1 is the viewed table, upvalue 2 the view cache.
+int viewpairs(lua_State *L) {
+  lua_pushvalue(L, lua_upvalueindex(1));
+  lua_pushvalue(L, lua_upvalueindex(2));
+  lua_pushcclosure(L, &viewnext, 2);
+  lua_pushvalue(L, 1);
+  lua_pushnil(L);
+  return 3;
+}
+
+// Pushes a read-only view of the value at index if it is a table, the value
+// itself otherwise. Views are kept in the cache table, so that a table always
+// has the same view.
+void pushview(lua_State *L, int index, int cache) {
+  index = lua_absindex(L, index);
+  if (!lua_istable(L, index)) {
+    lua_pushvalue(L, index);
+    return;
+  }
+  lua_pushvalue(L, index);
+  lua_rawget(L, cache);
+  if (!lua_isnil(L, -1)) {
+    return;
+  }
+  lua_pop(L, 1);
+  lua_newtable(L); // VIEW
+  lua_newtable(L); // METATABLE
+  lua_pushliteral(L, "__index");
+  lua_pushvalue(L, index);
+  lua_pushvalue(L, cache);
+  lua_pushcclosure(L, &viewindex, 2);
+  lua_rawset(L, -3);
+  lua_pushliteral(L, "__newindex");
+  lua_pushcfunction(L, &readonly);
+  lua_rawset(L, -3);
+  lua_pushliteral(L, "__len");
+  lua_pushvalue(L, index);
+  lua_pushcclosure(L, &viewlen, 1);
+  lua_rawset(L, -3);
+  lua_pushliteral(L, "__pairs");
+  lua_pushvalue(L, index);
+  lua_pushvalue(L, cache);
+  lua_pushcclosure(L, &viewpairs, 2);
+  lua_rawset(L, -3);
+  lua_pushliteral(L, "__metatable");
+  lua_pushliteral(L, "read-only");
+  lua_rawset(L, -3);
+  lua_setmetatable(L, -2);
+  lua_pushvalue(L, index);
+  lua_pushvalue(L, -2);
+  lua_rawset(L, cache);
+}
+
+// __index of the environment in which specialize() evaluates code. Only gives
+// access to names of the static context (upvalue 1) that no code of the
+// template assigns or declares (upvalue 2), through read-only views of tables
+// cached in upvalue 3. Any other name aborts the evaluation.
+int lookup(lua_State *L) {
+  lua_pushvalue(L, 2);
+  lua_rawget(L, lua_upvalueindex(2));
+  if (!lua_isnil(L, -1)) {
+    lua_pushliteral(L, "name may be assigned by the template");
+    return lua_error(L);
+  }
+  lua_pop(L, 1);
+  lua_pushvalue(L, 2);
+  lua_gettable(L, lua_upvalueindex(1));
+  if (lua_isnil(L, -1)) {
+    lua_pushliteral(L, "name is not in static context");
+    return lua_error(L);
   }
-  lua::newsandbox(L, -4);
+  pushview(L, -1, lua_upvalueindex(3));
+  return 1;
+}
+
+// A lua_Writer appending to a std::string. Returns non-zero if out of memory.
+int WriteString(lua_State *L, const void *data, size_t size, void *string) {
+  return append(static_cast<std::string *>(string),
+                static_cast<const char *>(data), size)
+             ? 0
+             : 1;
+}
+
+// A lua_Reader returning a whole buffer at once.
+struct Buffer {
+  const char *data;
+  size_t size;
+};
+
+const char *ReadBuffer(lua_State *L, void *data, size_t *size) {
+  Buffer *buffer = reinterpret_cast<Buffer *>(data);
+  *size = buffer->size;
+  buffer->size = 0;
+  return *size ? buffer->data : nullptr;
+}
+
+// Expects the static context, and the names the template may assign as a
+// light userdata to a std::vector<absl::string_view>. Returns a new box, and
+// the environment in which specialize() evaluates code, whose _o outputs to
+// the box. Called with lua_pcall(), so that a memory error does not skip
+// destructors of the caller.
+int newfoldenv(lua_State *L) {
+  const auto *assigned =
+      static_cast<const std::vector<absl::string_view> *>(lua_touserdata(L, 2));
+  lua_newtable(L); // NAMES
+  for (const absl::string_view name : *assigned) {
+    lua_pushlstring(L, name.data(), name.size());
+    lua_pushboolean(L, 1);
+    lua_rawset(L, 3);
+  }
+  newbox(L);       // BOX
+  lua_newtable(L); // ENV
   {
     lua_pushliteral(L, "_o");
-    lua_pushvalue(L, -5); // BLOCKS
-    lua_pushvalue(L, -5); // BLOCKS STACK
+    lua_pushvalue(L, 4); // BOX
+    lua_newtable(L);     // BLOCKS STACK, always empty.
+    lua_pushcclosure(L, &_o, 2);
+    lua_rawset(L, 5);
+  }
+  {
+    lua_newtable(L);
+    lua_pushliteral(L, "__index");
+    lua_pushvalue(L, 1); // CONTEXT
+    lua_pushvalue(L, 3); // NAMES
+    lua_newtable(L);     // VIEWS
+    lua_pushcclosure(L, &lookup, 3);
+    lua_rawset(L, -3);
+    lua_pushliteral(L, "__newindex");
+    lua_pushcfunction(L, &readonly);
+    lua_rawset(L, -3);
+    lua_setmetatable(L, 5);
+  }
+  lua_pushvalue(L, 4); // BOX
+  lua_pushvalue(L, 5); // ENV
+  return 2;
+}
+
+// Loads code in env and calls it with results results. Returns whether that
+// succeeded, and pops the error message if not.
+bool evaluate(lua_State *L, int env, absl::string_view code, int results,
+              const char *name) {
+  Buffer buffer = {code.data(), code.size()};
+  if (lua_load(L, ReadBuffer, &buffer, name, "t") == LUA_OK) {
+    lua_pushvalue(L, env);
+    lua_setupvalue(L, -2, 1);
+    if (lua_pcall(L, 0, results, 0) == LUA_OK) {
+      return true;
+    }
+  }
+  lua_pop(L, 1); // Error message.
+  return false;
+}
+
+// Evaluates an _o call in env, whose _o outputs to box, set to result for the
+// time of the evaluation. Returns whether that succeeded.
+bool fold(lua_State *L, int env, jude::RenderResult **box,
+          jude::RenderResult *result, absl::string_view code,
+          const char *name) {
+  result->Clear();
+  *box = result;
+  const bool folded =
+      evaluate(L, env, absl::StrCat("_o(", code, ")"), 0, name);
+  *box = nullptr;
+  return folded;
+}
+
+// What a condition evaluates to ahead of rendering.
+enum class Outcome { ALWAYS, NEVER, DYNAMIC };
+
+Outcome test(lua_State *L, int env, absl::string_view condition,
+             const char *name) {
+  if (!evaluate(L, env, absl::StrCat("return ", condition), 1, name)) {
+    return Outcome::DYNAMIC;
+  }
+  const bool value = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+  return value ? Outcome::ALWAYS : Outcome::NEVER;
+}
+
+// A template being specialized: its segments, their tokens, and whether each
+// was folded, i.e. replaced by text.
+struct Specialization {
+  std::vector<jude::Reader::Segment> segments;
+  std::vector<std::vector<jude::Token>> tokens;
+  std::vector<bool> folded;
+  std::vector<std::string> values;
+
+  void Drop(size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      folded[i] = true;
+      values[i].clear();
+    }
+  }
+  void Rewrite(size_t i, std::string code) {
+    segments[i].code = std::move(code);
+    tokens[i] = jude::Tokenize(segments[i].code);
+  }
+};
+
+// Returns the condition of a statement like "if c then", where keyword is
+// "if", or an empty view if the statement is not one.
+absl::string_view condition(const std::vector<jude::Token> &tokens,
+                            absl::string_view keyword) {
+  if (tokens.size() < 3 || !jude::IsKeyword(tokens.front(), keyword) ||
+      !jude::IsKeyword(tokens.back(), "then")) {
+    return absl::string_view();
+  }
+  for (size_t i = 1; i + 1 < tokens.size(); ++i) {
+    for (const char *other : {"if", "then", "elseif", "else", "end"}) {
+      if (jude::IsKeyword(tokens[i], other)) {
+        return absl::string_view();
+      }
+    }
+  }
+  const char *begin = tokens[1].text.data();
+  return absl::string_view(begin, tokens.back().text.data() - begin);
+}
+
+bool single(const std::vector<jude::Token> &tokens, absl::string_view keyword) {
+  return tokens.size() == 1 && jude::IsKeyword(tokens[0], keyword);
+}
+
+// Folds the if statement starting at segment first, if its conditions can be
+// evaluated ahead: branches that are never taken are dropped, and so is the
+// statement itself if a branch is always taken. Marks statements of the if
+// statement as done.
+void foldif(lua_State *L, int env, const char *name, size_t first,
+            Specialization *s, std::vector<bool> *done) {
+  struct Branch {
+    size_t delimiter;
+    absl::string_view condition; // Empty for else.
+  };
+  std::vector<Branch> branches = {{first, condition(s->tokens[first], "if")}};
+  if (branches[0].condition.empty()) {
+    return;
+  }
+  // Find the branches, at the same depth of nested blocks.
+  size_t last = first;
+  int depth = 0;
+  for (size_t i = first + 1; i < s->segments.size() && last == first; ++i) {
+    if (s->segments[i].kind != jude::Reader::Segment::Kind::STATEMENT ||
+        s->folded[i]) {
+      continue;
+    }
+    const std::vector<jude::Token> &tokens = s->tokens[i];
+    if (depth == 0) {
+      if (single(tokens, "end")) {
+        last = i;
+        continue;
+      }
+      if (single(tokens, "else")) {
+        branches.push_back({i, absl::string_view()});
+        continue;
+      }
+      const absl::string_view elseif = condition(tokens, "elseif");
+      if (!elseif.empty()) {
+        branches.push_back({i, elseif});
+        continue;
+      }
+      for (const jude::Token &token : tokens) {
+        if (jude::IsKeyword(token, "else") ||
+            jude::IsKeyword(token, "elseif")) {
+          return;
+        }
+      }
+    }
+    depth += jude::BlockDelta(tokens);
+    if (depth < 0) {
+      return;
+    }
+  }
+  if (last == first) {
+    return;
+  }
+  for (size_t b = 0; b + 1 < branches.size(); ++b) {
+    if (branches[b].condition.empty()) {
+      return; // Else must be last.
+    }
+  }
+  for (const Branch &branch : branches) {
+    (*done)[branch.delimiter] = true;
+  }
+  (*done)[last] = true;
+
+  bool kept = false;  // Whether a branch is kept with its delimiter.
+  bool taken = false; // Whether a branch is always taken.
+  bool scoped = false; // Whether the taken branch is kept as a do block.
+  for (size_t b = 0; b < branches.size(); ++b) {
+    const size_t begin = branches[b].delimiter;
+    const size_t end =
+        b + 1 < branches.size() ? branches[b + 1].delimiter : last;
+    const absl::string_view condition = branches[b].condition;
+    const Outcome outcome =
+        taken ? Outcome::NEVER
+              : condition.empty() ? Outcome::ALWAYS
+                                  : test(L, env, condition, name);
+    switch (outcome) {
+    case Outcome::NEVER:
+      s->Drop(begin, end);
+      break;
+    case Outcome::DYNAMIC:
+      if (!kept && b > 0) {
+        // First kept elseif becomes the if.
+        const std::string &code = s->segments[begin].code;
+        const size_t keyword = s->tokens[begin][0].text.data() - code.data();
+        s->Rewrite(begin, absl::StrCat(code.substr(0, keyword), "if",
+                                       code.substr(keyword + 6)));
+      }
+      kept = true;
+      break;
+    case Outcome::ALWAYS:
+      taken = true;
+      if (kept) {
+        s->Rewrite(begin, "else");
+        break;
+      }
+      // Keep the branch alone, in a do block if it has statements that could
+      // declare locals.
+      for (size_t i = begin + 1; i < end; ++i) {
+        scoped = scoped ||
+                 s->segments[i].kind == jude::Reader::Segment::Kind::STATEMENT;
+      }
+      if (scoped) {
+        s->Rewrite(begin, "do");
+      } else {
+        s->Drop(begin, begin + 1);
+      }
+      break;
+    }
+  }
+  if (!kept && !scoped) {
+    s->Drop(last, last + 1);
+  }
+}
+
+// Appends to program an _o call outputting text, if not empty, followed by
+// lines newlines. Newlines of text are kept as such as long as possible, so
+// that line numbers of the program match those of the template.
+void flush(std::string *text, int *lines, std::string *program) {
+  if (!text->empty()) {
+    program->append("_o(\"");
+    for (const char c : *text) {
+      if (c == '\n' && *lines > 0) {
+        program->append("\\\n");
+        --*lines;
+      } else if (c == '"' || c == '\\') {
+        program->push_back('\\');
+        program->push_back(c);
+      } else if (static_cast<unsigned char>(c) < ' ' || c == '\x7f') {
+        const unsigned char code = c;
+        absl::StrAppend(program, "\\", absl::Dec(code, absl::kZeroPad3));
+      } else {
+        program->push_back(c);
+      }
+    }
+    program->append("\")");
+    text->clear();
+  }
+  program->append(*lines, '\n');
+  *lines = 0;
+}
+
+// Switches the collector to the mode of the policy. Returns whether endgc()
+// must restart it. Modes other than STOPPED are rejected by run() before Lua
+// 5.4.
+bool begingc(lua_State *L, const jude::GcPolicy &gc) {
+  using During = jude::GcPolicy::During;
+  switch (gc.during) {
+  case During::UNCHANGED:
+    return false;
+  case During::INCREMENTAL:
+#if LUA_VERSION_NUM >= 504
+    lua_gc(L, LUA_GCINC, 0, 0, 0);
+#endif
+    return false;
+  case During::GENERATIONAL:
+#if LUA_VERSION_NUM >= 504
+    lua_gc(L, LUA_GCGEN, 0, 0);
+#endif
+    return false;
+  case During::STOPPED:
+    if (!lua_gc(L, LUA_GCISRUNNING, 0)) {
+      return false;
+    }
+    lua_gc(L, LUA_GCSTOP, 0);
+    return true;
+  }
+  return false;
+}
+
+void endgc(lua_State *L, const jude::GcPolicy &gc, bool restart) {
+  using After = jude::GcPolicy::After;
+  if (restart) {
+    lua_gc(L, LUA_GCRESTART, 0);
+  }
+  switch (gc.after) {
+  case After::NOTHING:
+    break;
+  case After::STEP:
+    lua_gc(L, LUA_GCSTEP, gc.step_kb);
+    break;
+  case After::COLLECT:
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    return;
+  }
+  if (gc.high_water_kb && lua_gc(L, LUA_GCCOUNT, 0) > gc.high_water_kb) {
+    lua_gc(L, LUA_GCCOLLECT, 0);
+  }
+}
+
+// Expects a loaded chunk and a table. Sets the environment of the chunk to a
+// sandbox of the table, with functions outputting to a new box. Returns the
+// box and the chunk.
+int prepare(lua_State *L) {
+  lua_newtable(L); // BLOCKS STACK
+  newbox(L);       // BOX
+  lua::newsandbox(L, 2);
+  {
+    lua_pushliteral(L, "_o");
+    lua_pushvalue(L, 4); // BOX
+    lua_pushvalue(L, 3); // BLOCKS STACK
     lua_pushcclosure(L, &_o, 2);
     lua_rawset(L, -3);
   }
   {
     lua_pushliteral(L, "beginblock");
-    lua_pushvalue(L, -4); // BLOCKS STACK
+    lua_pushvalue(L, 3); // BLOCKS STACK
     lua_pushcclosure(L, &beginblock, 1);
     lua_rawset(L, -3);
   }
   {
     lua_pushliteral(L, "endblock");
-    lua_pushvalue(L, -4); // BLOCKS STACK
+    lua_pushvalue(L, 3); // BLOCKS STACK
     lua_pushcclosure(L, &endblock, 1);
     lua_rawset(L, -3);
   }
+  lua_setupvalue(L, 1, 1);
+  lua_pushvalue(L, 4); // BOX
+  lua_pushvalue(L, 1); // CHUNK
+  return 2;
+}
+
+// Expects a loaded chunk on top of an environment table, leaves the table.
+// Runs the chunk, outputting blocks to result. Lua allocations, which may
+// fail, are done under lua_pcall() like the chunk.
+int run(lua_State *L, jude::RenderResult *result,
+        const jude::GcPolicy &gc) noexcept {
+  result->Clear();
+#if LUA_VERSION_NUM < 504
+  if (gc.during == jude::GcPolicy::During::INCREMENTAL ||
+      gc.during == jude::GcPolicy::During::GENERATIONAL) {
+    lua_pop(L, 1);
+    lua_pushliteral(L, "collector modes need Lua 5.4");
+    return LUA_ERRRUN;
+  }
+#endif
+  lua_pushcfunction(L, &prepare);
+  lua_insert(L, -2);
+  lua_pushvalue(L, -3);
+  if (int error = lua_pcall(L, 2, 2, 0)) {
+    return error;
+  }
+  auto **box = static_cast<jude::RenderResult **>(lua_touserdata(L, -2));
+  const bool restart = begingc(L, gc);
+  *box = result;
+  const int error = lua_pcall(L, 0, 0, 0);
+  *box = nullptr;
+  endgc(L, gc, restart);
+  lua_remove(L, error ? -2 : -1); // BOX
+  return error;
+}
+
+// Pushes the blocks of the RenderResult given as light userdata as a table of
+// strings. Called with lua_pcall(), so that a memory error does not skip
+// destructors of the caller.
+int pushblocks(lua_State *L) {
+  const auto *result =
+      static_cast<const jude::RenderResult *>(lua_touserdata(L, 1));
+  lua_newtable(L);
+  for (const auto &block : result->blocks()) {
+    lua_pushlstring(L, block.first.data(), block.first.size());
+    lua_pushlstring(L, block.second.data(), block.second.size());
+    lua_rawset(L, -3);
+  }
+  return 1;
+}
+
+// Pushes the std::string given as light userdata. Called with lua_pcall(), so
+// that a memory error does not skip destructors of the caller.
+int pushstring(lua_State *L) {
+  const auto *string = static_cast<const std::string *>(lua_touserdata(L, 1));
+  lua_pushlstring(L, string->data(), string->size());
+  return 1;
+}
+
+} // namespace
+
+namespace jude {
+
+absl::string_view RenderResult::Block(absl::string_view name) const {
+  const auto it = blocks_.find(name);
+  return it == blocks_.end() ? absl::string_view() : it->second;
+}
+
+std::string *RenderResult::MutableBlock(absl::string_view name) {
+  return &blocks_[name];
+}
+
+int render(lua_State *L, const char *data, size_t size, const char *name,
+           RenderResult *result, const GcPolicy &gc) noexcept {
+  Reader reader(data, size);
+  if (int error = lua_load(L, Reader::Read, &reader, name, "t")) {
+    return error;
+  }
+  return run(L, result, gc);
+}
+
+int dostring(lua_State *L, const char *data, size_t size, const char *name,
+             const GcPolicy &gc) noexcept {
+  RenderResult result;
+  if (int error = render(L, data, size, name, &result, gc)) {
+    return error;
+  }
+  lua_pushcfunction(L, &pushblocks);
+  lua_pushlightuserdata(L, &result);
+  return lua_pcall(L, 1, 1, 0);
+}
+
+int specialize(lua_State *L, const char *data, size_t size,
+               const char *name) noexcept {
+  const int context = lua_absindex(L, -1);
+  Specialization s;
+  {
+    Reader reader(data, size);
+    Reader::Segment segment;
+    while (reader.Next(&segment)) {
+      s.segments.push_back(segment);
+    }
+  }
+  s.tokens.resize(s.segments.size());
+  s.folded.resize(s.segments.size());
+  s.values.resize(s.segments.size());
+
+  // Collect names the template may assign or declare. Code using _ENV could
+  // assign anything, so nothing is folded then.
+  bool dynamic = false;
+  std::vector<absl::string_view> assigned;
+  for (size_t i = 0; i < s.segments.size(); ++i) {
+    if (s.segments[i].kind == Reader::Segment::Kind::TEXT) {
+      continue;
+    }
+    s.tokens[i] = Tokenize(s.segments[i].code);
+    for (const Token &token : s.tokens[i]) {
+      dynamic = dynamic ||
+                (token.kind == Token::Kind::NAME && token.text == "_ENV");
+    }
+    const std::vector<absl::string_view> names = AssignedNames(s.tokens[i]);
+    assigned.insert(assigned.end(), names.begin(), names.end());
+  }
+  lua_pushcfunction(L, &newfoldenv);
+  lua_pushvalue(L, context);
+  lua_pushlightuserdata(L, &assigned);
+  if (int error = lua_pcall(L, 2, 2, 0)) {
+    return error;
+  }
+  auto **box = static_cast<RenderResult **>(lua_touserdata(L, -2));
+  const int env = lua_gettop(L);
+  RenderResult result;
+
+  // Fold if statements whose conditions only depend on the static context,
+  // then evaluate each remaining _o call that only depends on it. Each piece
+  // of code is evaluated at most once.
+  if (!dynamic) {
+    std::vector<bool> done(s.segments.size());
+    for (size_t i = 0; i < s.segments.size(); ++i) {
+      if (s.segments[i].kind == Reader::Segment::Kind::STATEMENT &&
+          !s.folded[i] && !done[i]) {
+        foldif(L, env, name, i, &s, &done);
+      }
+    }
+    for (size_t i = 0; i < s.segments.size(); ++i) {
+      if (s.segments[i].kind == Reader::Segment::Kind::STATEMENT ||
+          s.folded[i]) {
+        continue;
+      }
+      s.folded[i] = fold(L, env, box, &result, s.segments[i].code, name);
+      if (s.folded[i]) {
+        s.values[i] = std::string(result.Block(kUnnamed));
+      }
+    }
+  }
+  lua_pop(L, 2); // BOX ENV
+
+  // Merge folded segments with neighbouring text. Other segments are preceded
+  // by the newlines consumed before them, and followed by those they consumed
+  // but do not contain, so that line numbers are kept.
+  std::string program;
+  std::string text;
+  int lines = 0;
+  for (size_t i = 0; i < s.segments.size(); ++i) {
+    const Reader::Segment &segment = s.segments[i];
+    if (s.folded[i]) {
+      text.append(s.values[i]);
+      lines += segment.lines;
+      continue;
+    }
+    flush(&text, &lines, &program);
+    program.append(segment.lines_before, '\n');
+    if (segment.kind == Reader::Segment::Kind::STATEMENT) {
+      absl::StrAppend(&program, " ", segment.code, " ");
+    } else {
+      absl::StrAppend(&program, "_o(", segment.code, ")");
+    }
+    const int contained =
+        std::count(segment.code.begin(), segment.code.end(), '\n');
+    lines += std::max(0, segment.lines - segment.lines_before - contained);
+  }
+  flush(&text, &lines, &program);
+
+  Buffer buffer = {program.data(), program.size()};
+  if (int error = lua_load(L, ReadBuffer, &buffer, name, "t")) {
+    return error;
+  }
+  std::string bytecode;
+#if LUA_VERSION_NUM >= 503
+  const int dumped = lua_dump(L, WriteString, &bytecode, 0);
+#else
+  const int dumped = lua_dump(L, WriteString, &bytecode);
+#endif
+  lua_pop(L, 1);
+  if (dumped != 0) {
+    lua_pushliteral(L, "not enough memory");
+    return LUA_ERRMEM;
+  }
+  lua_pushcfunction(L, &pushstring);
+  lua_pushlightuserdata(L, &bytecode);
+  return lua_pcall(L, 1, 1, 0);
+}
+
+int renderspecialized(lua_State *L, const char *data, size_t size,
+                      const char *name, RenderResult *result,
+                      const GcPolicy &gc) noexcept {
+  Buffer buffer = {data, size};
+  if (int error = lua_load(L, ReadBuffer, &buffer, name, "b")) {
+    return error;
+  }
+  return run(L, result, gc);
+}
 
-  lua_setupvalue(L, -2, 1);
-  if (int error = lua_pcall(L, 0, 0, 0)) {
-    lua_remove(L, -3); // BLOCKS
-    lua_remove(L, -2); // BLOCKS STACK
+int dospecialized(lua_State *L, const char *data, size_t size,
+                  const char *name, const GcPolicy &gc) noexcept {
+  RenderResult result;
+  if (int error = renderspecialized(L, data, size, name, &result, gc)) {
     return error;
   }
-  lua_pop(L, 1); // BLOCKS STACK
-  return LUA_OK;
+  lua_pushcfunction(L, &pushblocks);
+  lua_pushlightuserdata(L, &result);
+  return lua_pcall(L, 1, 1, 0);
 }
 
 } // namespace jude
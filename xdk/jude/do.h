@@ -1,18 +1,96 @@
 #ifndef XDK_jude_DO_H
 #define XDK_jude_DO_H
 
+#include <string>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/string_view.h"
 #include "xdk/lua/lua.hpp"
 
 namespace xdk {
 namespace jude {
 
+// How the garbage collector runs around a render. The default leaves it alone.
+struct GcPolicy {
+  // Collector mode during the render. INCREMENTAL and GENERATIONAL switch the
+  // state to that mode and leave it there, since switching to GENERATIONAL
+  // runs a full collection; rendering fails with them before Lua 5.4, which
+  // has no such modes. STOPPED restarts the collector after the render.
+  enum class During { UNCHANGED, INCREMENTAL, GENERATIONAL, STOPPED };
+  // Collection done after the render: none, an incremental step of step_kb, or
+  // a full collection.
+  enum class After { NOTHING, STEP, COLLECT };
+
+  During during = During::UNCHANGED;
+  After after = After::NOTHING;
+  int step_kb = 0;
+  // If not zero, a full collection is also done after the render whenever the
+  // memory in use exceeds that many kilobytes.
+  int high_water_kb = 0;
+};
+
+// Blocks output by render(), keyed by name. The unnamed block is "_". Block
+// names are strings: beginblock() converts numbers, and rejects other types.
+class RenderResult final {
+public:
+  // Returns the content of a block, empty if nothing was output to it.
+  absl::string_view Block(absl::string_view name) const;
+  // Returns the content of a block, creating it if needed.
+  std::string *MutableBlock(absl::string_view name);
+  const absl::flat_hash_map<std::string, std::string> &blocks() const {
+    return blocks_;
+  }
+  void Clear() { blocks_.clear(); }
+
+private:
+  absl::flat_hash_map<std::string, std::string> blocks_;
+};
+
+// Expects a table on the stack, leaves it there.
+//
+// Returns LUA_OK if success. Blocks are output directly to result, which is
+// cleared first, without creating Lua strings for them.
+//
+// In case of error, pushes the error message.
+int render(lua_State *L, const char *data, size_t size, const char *name,
+           RenderResult *result, const GcPolicy &gc = GcPolicy()) noexcept;
+
+// Same as render(), but pushes the blocks as a table of strings.
+//
 // Expects a table on the stack, leaves it there.
 //
 // Returns LUA_OK if success.  Result is pushed on stack.
 //
 // In case of error, pushes the error message.
-int dostring(lua_State *L, const char *data, size_t size,
-             const char *name) noexcept;
+int dostring(lua_State *L, const char *data, size_t size, const char *name,
+             const GcPolicy &gc = GcPolicy()) noexcept;
+
+// Expects a table on the stack, holding the static context, leaves it there.
+//
+// Evaluates all expressions of the template that only depend on the static
+// context, and merges them with the surrounding text. If statements whose
+// conditions only depend on it are reduced to the branch they take. Other
+// statements are kept as is. Names the template may assign or declare are
+// not part of the static context, and nothing is evaluated if the template
+// uses _ENV. Evaluated code sees tables of the static context through
+// read-only views, and runs once. The static context must not change between
+// renders, and still be visible from the table passed to dospecialized().
+//
+// Returns LUA_OK if success. The specialized template is pushed on stack as a
+// string holding precompiled Lua code, to be used with dospecialized().
+//
+// In case of error, pushes the error message.
+int specialize(lua_State *L, const char *data, size_t size,
+               const char *name) noexcept;
+
+// Same as render(), for a template returned by specialize().
+int renderspecialized(lua_State *L, const char *data, size_t size,
+                      const char *name, RenderResult *result,
+                      const GcPolicy &gc = GcPolicy()) noexcept;
+
+// Same as dostring(), for a template returned by specialize().
+int dospecialized(lua_State *L, const char *data, size_t size,
+                  const char *name, const GcPolicy &gc = GcPolicy()) noexcept;
 
 } // namespace jude
 } // namespace xdk
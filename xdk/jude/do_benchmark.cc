@@ -0,0 +1,197 @@
+// Measures the latency of dostring() for each garbage collector policy, and
+// the allocations done by dostring() and render().
+//
+//   bazel run -c opt //xdk/jude:do_benchmark -- [renders]
+//
+// Prints the 50th and 99th percentiles of render latency, in microseconds,
+// and the allocations per render.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "xdk/jude/do.h"
+#include "xdk/lua/state.h"
+
+namespace {
+size_t news = 0;
+} // namespace
+
+// Counts C++ allocations, e.g. of RenderResult buffers.
+void *operator new(size_t size) {
+  ++news;
+  if (void *data = std::malloc(size)) {
+    return data;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *data) noexcept { std::free(data); }
+void operator delete(void *data, size_t) noexcept { std::free(data); }
+
+namespace xdk {
+namespace jude {
+namespace {
+
+// Wraps the allocator of a Lua state to count allocations and allocated bytes,
+// which include copies of output into Lua strings.
+struct Allocator {
+  lua_Alloc alloc;
+  void *data;
+  size_t allocations;
+  size_t bytes;
+
+  static void *Alloc(void *data, void *ptr, size_t osize, size_t nsize) {
+    auto *allocator = static_cast<Allocator *>(data);
+    const size_t size = ptr ? osize : 0;
+    if (nsize > size) {
+      ++allocator->allocations;
+      allocator->bytes += nsize - size;
+    }
+    return allocator->alloc(allocator->data, ptr, osize, nsize);
+  }
+};
+
+constexpr char kTemplate[] = R"(
+{%- beginblock('head') -%}
+<title>{{ title }}</title>
+{%- endblock() -%}
+<ul>
+{%- for i = 1, 200 do %}
+  <li class="{{ i % 2 == 0 and 'even' or 'odd' }}">
+    {{ items[i % #items + 1] }} {{ i }}
+  </li>
+{%- end %}
+</ul>
+)";
+
+struct Policy {
+  const char *name;
+  GcPolicy gc;
+};
+
+std::vector<Policy> Policies() {
+  std::vector<Policy> policies;
+  policies.push_back({"unchanged", GcPolicy()});
+#if LUA_VERSION_NUM >= 504
+  {
+    GcPolicy gc;
+    gc.during = GcPolicy::During::GENERATIONAL;
+    policies.push_back({"generational", gc});
+  }
+#endif
+  {
+    GcPolicy gc;
+    gc.during = GcPolicy::During::STOPPED;
+    gc.after = GcPolicy::After::STEP;
+    gc.step_kb = 64;
+    policies.push_back({"stopped+step", gc});
+  }
+  {
+    GcPolicy gc;
+    gc.during = GcPolicy::During::STOPPED;
+    gc.after = GcPolicy::After::COLLECT;
+    policies.push_back({"stopped+collect", gc});
+  }
+  {
+    GcPolicy gc;
+    gc.during = GcPolicy::During::STOPPED;
+    gc.high_water_kb = 1024;
+    policies.push_back({"stopped+high-water", gc});
+  }
+  return policies;
+}
+
+void PushContext(lua_State *L) {
+  lua_newtable(L);
+  lua_pushliteral(L, "Benchmark");
+  lua_setfield(L, -2, "title");
+  lua_newtable(L);
+  for (int i = 1; i <= 10; ++i) {
+    const std::string item = "item " + std::to_string(i);
+    lua_pushlstring(L, item.data(), item.size());
+    lua_rawseti(L, -2, i);
+  }
+  lua_setfield(L, -2, "items");
+}
+
+// Returns the latency in microseconds at percentile p of sorted latencies.
+double Percentile(const std::vector<double> &latencies, double p) {
+  return latencies[static_cast<size_t>(p * (latencies.size() - 1))];
+}
+
+// Renders with dostring() if result is null, with render() otherwise.
+int Allocations(const char *mode, RenderResult *result, int renders) {
+  const std::string source = kTemplate;
+  lua::State L;
+  PushContext(L);
+  Allocator allocator = {nullptr, nullptr, 0, 0};
+  allocator.alloc = lua_getallocf(L, &allocator.data);
+  lua_setallocf(L, &Allocator::Alloc, &allocator);
+  const size_t before = news;
+  for (int i = 0; i < renders; ++i) {
+    const int error =
+        result ? render(L, source.data(), source.size(), "benchmark", result)
+               : dostring(L, source.data(), source.size(), "benchmark");
+    if (error) {
+      std::fprintf(stderr, "%s\n", lua_tostring(L, -1));
+      return EXIT_FAILURE;
+    }
+    if (!result) {
+      lua_pop(L, 1);
+    }
+  }
+  std::printf("%-20s %10.1f %10.1f %10.1f\n", mode,
+              static_cast<double>(allocator.allocations) / renders,
+              static_cast<double>(allocator.bytes) / 1024 / renders,
+              static_cast<double>(news - before) / renders);
+  lua_setallocf(L, allocator.alloc, allocator.data);
+  return EXIT_SUCCESS;
+}
+
+int Run(int renders) {
+  const std::string source = kTemplate;
+  std::printf("%-20s %10s %10s\n", "policy", "p50 (us)", "p99 (us)");
+  for (const Policy &policy : Policies()) {
+    lua::State L;
+    PushContext(L);
+    std::vector<double> latencies;
+    latencies.reserve(renders);
+    for (int i = 0; i < renders; ++i) {
+      const auto start = std::chrono::steady_clock::now();
+      if (dostring(L, source.data(), source.size(), "benchmark", policy.gc)) {
+        std::fprintf(stderr, "%s\n", lua_tostring(L, -1));
+        return EXIT_FAILURE;
+      }
+      const auto stop = std::chrono::steady_clock::now();
+      lua_pop(L, 1);
+      latencies.push_back(
+          std::chrono::duration<double, std::micro>(stop - start).count());
+    }
+    std::sort(latencies.begin(), latencies.end());
+    std::printf("%-20s %10.1f %10.1f\n", policy.name,
+                Percentile(latencies, 0.50), Percentile(latencies, 0.99));
+  }
+
+  std::printf("\n%-20s %10s %10s %10s\n", "api", "lua allocs", "lua KB",
+              "c++ allocs");
+  RenderResult result;
+  if (Allocations("dostring", nullptr, renders) ||
+      Allocations("render", &result, renders)) {
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+} // namespace
+} // namespace jude
+} // namespace xdk
+
+int main(int argc, char **argv) {
+  const int renders = argc > 1 ? std::atoi(argv[1]) : 10000;
+  return renders > 0 ? xdk::jude::Run(renders) : EXIT_FAILURE;
+}
@@ -1,5 +1,6 @@
 #include "xdk/jude/do.h"
 
+#include <cstdlib>
 #include <string>
 
 #include "xdk/lua/matchers.h"
@@ -22,6 +23,13 @@ using ::testing::StrEq;
 
 class DoTest : public ::testing::Test {
 protected:
+  // Returns the string at index, which may hold zeros.
+  std::string String(int index) {
+    size_t size;
+    const char *data = lua_tolstring(L, index, &size);
+    return std::string(data, size);
+  }
+
   lua::State L;
 };
 
@@ -164,6 +172,449 @@ TEST_F(DoTest, LinesEndingWithExpressionWork) {
                                      "    other line.")));
 }
 
+TEST_F(DoTest, RenderOutputsBlocksToResult) {
+  lua_newtable(L);
+  const std::string source = R"(
+{%- beginblock('head') -%}
+the header
+{%- endblock() -%}
+main text {{ 1 + 2 }}{{ nil }})";
+  RenderResult result;
+  ASSERT_EQ(render(L, source.data(), source.size(), "test", &result), LUA_OK)
+      << Stack(L);
+  EXPECT_EQ(result.Block("_"), "main text 3");
+  EXPECT_EQ(result.Block("head"), "the header");
+  EXPECT_EQ(result.Block("missing"), "");
+  EXPECT_EQ(result.blocks().size(), 2u);
+  EXPECT_THAT(Stack::Element(L, -1), HasField("_", IsNil()));
+}
+
+TEST_F(DoTest, RenderClearsResult) {
+  lua_newtable(L);
+  RenderResult result;
+  result.MutableBlock("stale")->append("text");
+
+  const std::string source = "fresh";
+  ASSERT_EQ(render(L, source.data(), source.size(), "test", &result), LUA_OK)
+      << Stack(L);
+  EXPECT_EQ(result.Block("_"), "fresh");
+  EXPECT_EQ(result.Block("stale"), "");
+}
+
+int withmetatable(lua_State *L) {
+  lua_newtable(L);
+  lua_pushvalue(L, 1);
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+TEST_F(DoTest, ConcatMetamethodCanOutputToNewBlocks) {
+  lua_newtable(L);
+  lua_pushcfunction(L, &withmetatable);
+  lua_setfield(L, -2, "withmetatable");
+
+  const std::string source = R"({%
+mt = {__concat = function(a, b)
+  for i = 1, 100 do beginblock('block' .. i) _o('x') endblock() end
+  return b == '' and 'concat' or 'reversed'
+end}
+%}before {{ withmetatable(mt) }} after)";
+  RenderResult result;
+  ASSERT_EQ(render(L, source.data(), source.size(), "test", &result), LUA_OK)
+      << Stack(L);
+  EXPECT_EQ(result.Block("_"), "before concat after");
+  EXPECT_EQ(result.Block("block100"), "x");
+}
+
+TEST_F(DoTest, NumbersAreOutputLikeLua) {
+  const std::string source = "{{ x }}";
+  for (const std::string number :
+       {"1", "-7", "1.5", "2.0", "-0.0", "1e100", "2^63", "1/0"}) {
+    lua_newtable(L);
+    ASSERT_EQ(luaL_dostring(L, ("return " + number).c_str()), LUA_OK)
+        << Stack(L);
+    lua_pushvalue(L, -1);
+    const std::string expected = lua_tostring(L, -1);
+    lua_pop(L, 1);
+    lua_setfield(L, -2, "x");
+
+    RenderResult result;
+    ASSERT_EQ(render(L, source.data(), source.size(), "test", &result), LUA_OK)
+        << Stack(L);
+    EXPECT_EQ(result.Block("_"), expected) << number;
+    lua_pop(L, 1);
+  }
+}
+
+// Fails allocations of more than 1MB.
+void *limitedalloc(void *, void *ptr, size_t, size_t nsize) {
+  if (nsize == 0) {
+    std::free(ptr);
+    return nullptr;
+  }
+  return nsize > (1 << 20) ? nullptr : std::realloc(ptr, nsize);
+}
+
+TEST_F(DoTest, MemoryErrorsAreReported) {
+  lua_newtable(L);
+  void *data;
+  const lua_Alloc alloc = lua_getallocf(L, &data);
+  lua_setallocf(L, &limitedalloc, nullptr);
+
+  // The output fits in a RenderResult, but not in a Lua string.
+  const std::string source =
+      "{% for i = 1, 20 do %}" + std::string(100000, 'x') + "{% end %}";
+  ASSERT_EQ(dostring(L, source.data(), source.size(), "test"), LUA_ERRMEM);
+  EXPECT_THAT(Stack::Element(L, -1), IsString("not enough memory"));
+  lua_setallocf(L, alloc, data);
+}
+
+TEST_F(DoTest, OutputFailsAfterRender) {
+  lua_newtable(L);
+  lua_newtable(L);
+  lua_setfield(L, -2, "ctx");
+
+  const std::string source = "{% ctx.keep = _o %}";
+  ASSERT_EQ(dostring(L, source.data(), source.size(), "test"), LUA_OK)
+      << Stack(L);
+  lua_getfield(L, -2, "ctx");
+  lua_getfield(L, -1, "keep");
+  lua_pushliteral(L, "x");
+  ASSERT_EQ(lua_pcall(L, 1, 0, 0), LUA_ERRRUN);
+  EXPECT_THAT(Stack::Element(L, -1),
+              IsString(HasSubstr("_o() called outside of a render")));
+}
+
+TEST_F(DoTest, BlockNamesAreStrings) {
+  lua_newtable(L);
+  const std::string source = "{% beginblock(1) %}one{% endblock() %}";
+  ASSERT_EQ(dostring(L, source.data(), source.size(), "test"), LUA_OK)
+      << Stack(L);
+  EXPECT_THAT(Stack::Element(L, -1), HasField("1", IsString("one")));
+  lua_pop(L, 1);
+
+  const std::string invalid = "{% beginblock({}) %}";
+  ASSERT_EQ(dostring(L, invalid.data(), invalid.size(), "test"), LUA_ERRRUN);
+  EXPECT_THAT(Stack::Element(L, -1),
+              IsString(HasSubstr("beginblock() expects a string, got table")));
+}
+
+int gcisrunning(lua_State *L) {
+  lua_pushstring(L, lua_gc(L, LUA_GCISRUNNING, 0) ? "running" : "stopped");
+  return 1;
+}
+
+TEST_F(DoTest, GcCanBeStoppedDuringRender) {
+  lua_newtable(L);
+  lua_pushcfunction(L, &gcisrunning);
+  lua_setfield(L, -2, "gc");
+
+  GcPolicy gc;
+  gc.during = GcPolicy::During::STOPPED;
+  gc.after = GcPolicy::After::COLLECT;
+  const std::string source = "gc is {{ gc() }}";
+  ASSERT_EQ(dostring(L, source.data(), source.size(), "test", gc), LUA_OK)
+      << Stack(L);
+  EXPECT_THAT(Stack::Element(L, -1), HasField("_", IsString("gc is stopped")));
+  EXPECT_TRUE(lua_gc(L, LUA_GCISRUNNING, 0));
+}
+
+TEST_F(DoTest, GcIsRestoredAfterError) {
+  lua_newtable(L);
+
+  GcPolicy gc;
+  gc.during = GcPolicy::During::STOPPED;
+  gc.after = GcPolicy::After::STEP;
+  gc.step_kb = 16;
+  const std::string source = "{{ y .. 3 }}";
+  ASSERT_EQ(dostring(L, source.data(), source.size(), "test", gc), LUA_ERRRUN);
+  EXPECT_TRUE(lua_gc(L, LUA_GCISRUNNING, 0));
+}
+
+TEST_F(DoTest, GcStepRunsAfterRender) {
+  lua_gc(L, LUA_GCSTOP, 0);
+  for (int i = 0; i < 1000; ++i) {
+    lua_newtable(L);
+    lua_pop(L, 1);
+  }
+  const int before = lua_gc(L, LUA_GCCOUNT, 0);
+  lua_gc(L, LUA_GCRESTART, 0);
+  lua_newtable(L);
+
+  // Only the step can collect the garbage, since the collector is stopped
+  // during the render.
+  GcPolicy gc;
+  gc.during = GcPolicy::During::STOPPED;
+  gc.after = GcPolicy::After::STEP;
+  gc.step_kb = 1024;
+  const std::string source = "text";
+  ASSERT_EQ(dostring(L, source.data(), source.size(), "test", gc), LUA_OK)
+      << Stack(L);
+  EXPECT_LT(lua_gc(L, LUA_GCCOUNT, 0), before);
+  EXPECT_TRUE(lua_gc(L, LUA_GCISRUNNING, 0));
+}
+
+TEST_F(DoTest, GcCollectsAboveHighWaterMark) {
+  lua_gc(L, LUA_GCSTOP, 0);
+  for (int i = 0; i < 1000; ++i) {
+    lua_newtable(L);
+    lua_pop(L, 1);
+  }
+  const int before = lua_gc(L, LUA_GCCOUNT, 0);
+  lua_newtable(L);
+
+  GcPolicy gc;
+  gc.high_water_kb = 1;
+  const std::string source = "text";
+  ASSERT_EQ(dostring(L, source.data(), source.size(), "test", gc), LUA_OK)
+      << Stack(L);
+  EXPECT_LT(lua_gc(L, LUA_GCCOUNT, 0), before);
+}
+
+#if LUA_VERSION_NUM >= 504
+TEST_F(DoTest, GcGenerationalModeIsKept) {
+  lua_newtable(L);
+
+  GcPolicy gc;
+  gc.during = GcPolicy::During::GENERATIONAL;
+  const std::string source = "text";
+  ASSERT_EQ(dostring(L, source.data(), source.size(), "test", gc), LUA_OK)
+      << Stack(L);
+  EXPECT_EQ(lua_gc(L, LUA_GCINC, 0, 0, 0), LUA_GCGEN);
+}
+#else
+TEST_F(DoTest, GcModesNeedLua54) {
+  lua_newtable(L);
+
+  GcPolicy gc;
+  gc.during = GcPolicy::During::GENERATIONAL;
+  const std::string source = "text";
+  ASSERT_EQ(dostring(L, source.data(), source.size(), "test", gc), LUA_ERRRUN);
+  EXPECT_THAT(Stack::Element(L, -1), IsString(HasSubstr("need Lua 5.4")));
+}
+#endif
+
+TEST_F(DoTest, SpecializeFoldsStaticExpressions) {
+  lua_newtable(L);
+  lua_pushstring(L, "jude");
+  lua_setfield(L, -2, "site");
+
+  const std::string source = R"(Welcome to {{ site }}, {{ user }}!)";
+  ASSERT_EQ(specialize(L, source.data(), source.size(), "test"), LUA_OK)
+      << Stack(L);
+  const std::string specialized = String(-1);
+  EXPECT_EQ(specialized.substr(0, 4), LUA_SIGNATURE);
+
+  lua_newtable(L);
+  lua_pushstring(L, "bob");
+  lua_setfield(L, -2, "user");
+  ASSERT_EQ(dospecialized(L, specialized.data(), specialized.size(), "test"),
+            LUA_OK)
+      << Stack(L);
+  EXPECT_THAT(Stack::Element(L, -1),
+              HasField("_", IsString("Welcome to jude, bob!")));
+}
+
+TEST_F(DoTest, SpecializeEscapesFoldedText) {
+  lua_newtable(L);
+  lua_pushstring(L, "\"quoted\"\r\n\\");
+  lua_setfield(L, -2, "text");
+
+  const std::string source = "{{ text }}";
+  ASSERT_EQ(specialize(L, source.data(), source.size(), "test"), LUA_OK)
+      << Stack(L);
+  const std::string specialized = String(-1);
+
+  lua_newtable(L);
+  ASSERT_EQ(dospecialized(L, specialized.data(), specialized.size(), "test"),
+            LUA_OK)
+      << Stack(L);
+  EXPECT_THAT(Stack::Element(L, -1),
+              HasField("_", IsString("\"quoted\"\r\n\\")));
+}
+
+TEST_F(DoTest, SpecializeKeepsNamesMentionedInStatements) {
+  lua_newtable(L);
+  lua_pushstring(L, "jude");
+  lua_setfield(L, -2, "site");
+
+  const std::string source = R"({{ site }} {% site = "other" %}{{ site }})";
+  ASSERT_EQ(specialize(L, source.data(), source.size(), "test"), LUA_OK)
+      << Stack(L);
+  const std::string specialized = String(-1);
+
+  lua_pushvalue(L, -2);
+  ASSERT_EQ(dospecialized(L, specialized.data(), specialized.size(), "test"),
+            LUA_OK)
+      << Stack(L);
+  EXPECT_THAT(Stack::Element(L, -1), HasField("_", IsString("jude other")));
+}
+
+TEST_F(DoTest, SpecializeKeepsNamesSetByExpressions) {
+  lua_newtable(L);
+  lua_pushstring(L, "static");
+  lua_setfield(L, -2, "x");
+
+  const std::string source = "{{ (function() x = 1 end)() }}{{ x }}";
+  ASSERT_EQ(specialize(L, source.data(), source.size(), "test"), LUA_OK)
+      << Stack(L);
+  const std::string specialized = String(-1);
+
+  lua_pushvalue(L, -2);
+  ASSERT_EQ(dospecialized(L, specialized.data(), specialized.size(), "test"),
+            LUA_OK)
+      << Stack(L);
+  EXPECT_THAT(Stack::Element(L, -1), HasField("_", IsString("1")));
+}
+
+TEST_F(DoTest, SpecializeKeepsLineNumbers) {
+  lua_newtable(L);
+
+  const std::string source = "line 1\n{{\n'folded'\n}}\n{{ y .. 3 }}";
+  ASSERT_EQ(specialize(L, source.data(), source.size(), "test"), LUA_OK)
+      << Stack(L);
+  const std::string specialized = String(-1);
+
+  lua_newtable(L);
+  ASSERT_EQ(dospecialized(L, specialized.data(), specialized.size(), "test"),
+            LUA_ERRRUN);
+  EXPECT_THAT(Stack::Element(L, -1),
+              IsString(HasSubstr(":5: attempt to concatenate")));
+}
+
+TEST_F(DoTest, SpecializeKeepsLineNumbersWithWhitespaceControl) {
+  lua_newtable(L);
+
+  const std::string source =
+      "line 1\n{%- local x = 1 -%}\n{{ 'folded' }}\n{{ y .. 3 }}";
+  ASSERT_EQ(specialize(L, source.data(), source.size(), "test"), LUA_OK)
+      << Stack(L);
+  const std::string specialized = String(-1);
+
+  lua_newtable(L);
+  ASSERT_EQ(dospecialized(L, specialized.data(), specialized.size(), "test"),
+            LUA_ERRRUN);
+  EXPECT_THAT(Stack::Element(L, -1),
+              IsString(HasSubstr(":4: attempt to concatenate")));
+}
+
+TEST_F(DoTest, SpecializeFoldsNamesOnlyReadByStatements) {
+  lua_newtable(L);
+  lua_pushstring(L, "jude");
+  lua_setfield(L, -2, "site");
+
+  const std::string source = "{% local name = site %}{{ site }} {{ name }}";
+  ASSERT_EQ(specialize(L, source.data(), source.size(), "test"), LUA_OK)
+      << Stack(L);
+  const std::string specialized = String(-1);
+
+  // Only the folded expression still gives the static value.
+  lua_newtable(L);
+  lua_pushstring(L, "other");
+  lua_setfield(L, -2, "site");
+  ASSERT_EQ(dospecialized(L, specialized.data(), specialized.size(), "test"),
+            LUA_OK)
+      << Stack(L);
+  EXPECT_THAT(Stack::Element(L, -1), HasField("_", IsString("jude other")));
+}
+
+TEST_F(DoTest, SpecializeDropsBranchesNeverTaken) {
+  ASSERT_EQ(luaL_dostring(L, "return {site = 'jude', flags = {beta = false}}"),
+            LUA_OK)
+      << Stack(L);
+
+  const std::string source = "{% if flags.beta then %}beta"
+                             "{% elseif user then %}{{ user }}"
+                             "{% else %}{{ site }}{% end %}";
+  ASSERT_EQ(specialize(L, source.data(), source.size(), "test"), LUA_OK)
+      << Stack(L);
+  const std::string specialized = String(-1);
+
+  // Flags are not needed anymore.
+  lua_newtable(L);
+  lua_pushstring(L, "bob");
+  lua_setfield(L, -2, "user");
+  ASSERT_EQ(dospecialized(L, specialized.data(), specialized.size(), "test"),
+            LUA_OK)
+      << Stack(L);
+  EXPECT_THAT(Stack::Element(L, -1), HasField("_", IsString("bob")));
+
+  lua_newtable(L);
+  ASSERT_EQ(dospecialized(L, specialized.data(), specialized.size(), "test"),
+            LUA_OK)
+      << Stack(L);
+  EXPECT_THAT(Stack::Element(L, -1), HasField("_", IsString("jude")));
+}
+
+TEST_F(DoTest, SpecializeKeepsBranchAlwaysTaken) {
+  ASSERT_EQ(luaL_dostring(L, "return {flags = {beta = true}}"), LUA_OK)
+      << Stack(L);
+
+  const std::string source = "{% if flags.beta then %}"
+                             "{% local x = 'beta' %}{{ x }}"
+                             "{% else %}stable{% end %}{{ x }}";
+  ASSERT_EQ(specialize(L, source.data(), source.size(), "test"), LUA_OK)
+      << Stack(L);
+  const std::string specialized = String(-1);
+
+  // The local stays in the scope of the branch.
+  lua_newtable(L);
+  lua_pushstring(L, "!");
+  lua_setfield(L, -2, "x");
+  ASSERT_EQ(dospecialized(L, specialized.data(), specialized.size(), "test"),
+            LUA_OK)
+      << Stack(L);
+  EXPECT_THAT(Stack::Element(L, -1), HasField("_", IsString("beta!")));
+}
+
+TEST_F(DoTest, SpecializeDoesNotChangeStaticContext) {
+  ASSERT_EQ(luaL_dostring(L, "return {items = {'a'}, push = function(t) "
+                             "t[#t + 1] = 'b' return #t end}"),
+            LUA_OK)
+      << Stack(L);
+
+  const std::string source = "{{ push(items) }}";
+  ASSERT_EQ(specialize(L, source.data(), source.size(), "test"), LUA_OK)
+      << Stack(L);
+  const std::string specialized = String(-1);
+
+  lua_getfield(L, -2, "items");
+  EXPECT_EQ(lua_rawlen(L, -1), 1u);
+  lua_pop(L, 1);
+
+  lua_pushvalue(L, -2);
+  ASSERT_EQ(dospecialized(L, specialized.data(), specialized.size(), "test"),
+            LUA_OK)
+      << Stack(L);
+  EXPECT_THAT(Stack::Element(L, -1), HasField("_", IsString("2")));
+}
+
+TEST_F(DoTest, SpecializeFoldsNothingIfEnvIsUsed) {
+  lua_newtable(L);
+  lua_pushstring(L, "jude");
+  lua_setfield(L, -2, "site");
+
+  const std::string source = "{{ site }} {% _ENV.site = 'other' %}{{ site }}";
+  ASSERT_EQ(specialize(L, source.data(), source.size(), "test"), LUA_OK)
+      << Stack(L);
+  const std::string specialized = String(-1);
+
+  lua_pushvalue(L, -2);
+  ASSERT_EQ(dospecialized(L, specialized.data(), specialized.size(), "test"),
+            LUA_OK)
+      << Stack(L);
+  EXPECT_THAT(Stack::Element(L, -1), HasField("_", IsString("jude other")));
+}
+
+TEST_F(DoTest, SpecializeReportsLoadError) {
+  lua_newtable(L);
+  const std::string source = "{% x = foo( %}";
+  int error = specialize(L, source.data(), source.size(), "test");
+  ASSERT_EQ(error, LUA_ERRSYNTAX);
+  EXPECT_THAT(Stack::Element(L, -1),
+              IsString(HasSubstr("unexpected symbol near <eof>")));
+}
+
 } // namespace
 } // namespace jude
 } // namespace xdk
@@ -0,0 +1,206 @@
+#include "xdk/jude/lexer.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <iterator>
+#include <string>
+
+#include "absl/strings/match.h"
+
+namespace xdk {
+namespace jude {
+namespace {
+
+constexpr absl::string_view kKeywords[] = {
+    "and",  "break", "do",     "else",   "elseif", "end",   "false", "for",
+    "function", "goto", "if",  "in",     "local",  "nil",   "not",   "or",
+    "repeat",   "return", "then", "true", "until",  "while",
+};
+
+constexpr absl::string_view kSymbols[] = {
+    "...", "..", "==", "~=", "<=", ">=", "//", "::", "<<", ">>",
+};
+
+bool IsNameStart(char c) {
+  return std::isalpha(static_cast<unsigned char>(c)) || c == '_';
+}
+
+bool IsNameChar(char c) {
+  return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+}
+
+bool IsDigit(char c) { return std::isdigit(static_cast<unsigned char>(c)); }
+
+bool IsSymbol(const Token &token, absl::string_view text) {
+  return token.kind == Token::Kind::SYMBOL && token.text == text;
+}
+
+// Returns the size of the long bracket, like "[==[", at the start of code, or 0
+// if there is none.
+size_t LongBracket(absl::string_view code) {
+  if (code.empty() || code[0] != '[') {
+    return 0;
+  }
+  size_t size = 1;
+  while (size < code.size() && code[size] == '=') {
+    ++size;
+  }
+  return size < code.size() && code[size] == '[' ? size + 1 : 0;
+}
+
+// Returns the size of the long string or comment at the start of code, whose
+// opening long bracket has the given size.
+size_t LongString(absl::string_view code, size_t bracket) {
+  const std::string closing = "]" + std::string(bracket - 2, '=') + "]";
+  const size_t end = code.find(closing, bracket);
+  return end == absl::string_view::npos ? code.size() : end + closing.size();
+}
+
+// Returns the size of the quoted string at the start of code.
+size_t QuotedString(absl::string_view code) {
+  size_t size = 1;
+  while (size < code.size() && code[size] != code[0]) {
+    size += code[size] == '\\' ? 2 : 1;
+  }
+  return std::min(size + 1, code.size());
+}
+
+size_t Number(absl::string_view code) {
+  size_t size = 1;
+  while (size < code.size() &&
+         (IsNameChar(code[size]) || code[size] == '.' ||
+          ((code[size] == '+' || code[size] == '-') &&
+           std::strchr("eEpP", code[size - 1]) != nullptr))) {
+    ++size;
+  }
+  return size;
+}
+
+} // namespace
+
+bool IsKeyword(const Token &token, absl::string_view text) {
+  return token.kind == Token::Kind::KEYWORD && token.text == text;
+}
+
+std::vector<Token> Tokenize(absl::string_view code) {
+  std::vector<Token> tokens;
+  while (!code.empty()) {
+    const char c = code[0];
+    if (std::isspace(static_cast<unsigned char>(c))) {
+      code.remove_prefix(1);
+      continue;
+    }
+    if (absl::StartsWith(code, "--")) {
+      code.remove_prefix(2);
+      if (const size_t bracket = LongBracket(code)) {
+        code.remove_prefix(LongString(code, bracket));
+      } else {
+        code.remove_prefix(std::min(code.find('\n'), code.size()));
+      }
+      continue;
+    }
+    Token token = {Token::Kind::SYMBOL, code.substr(0, 1)};
+    if (const size_t bracket = LongBracket(code)) {
+      token = {Token::Kind::STRING, code.substr(0, LongString(code, bracket))};
+    } else if (c == '"' || c == '\'') {
+      token = {Token::Kind::STRING, code.substr(0, QuotedString(code))};
+    } else if (IsNameStart(c)) {
+      size_t size = 1;
+      while (size < code.size() && IsNameChar(code[size])) {
+        ++size;
+      }
+      token.text = code.substr(0, size);
+      token.kind = std::find(std::begin(kKeywords), std::end(kKeywords),
+                             token.text) != std::end(kKeywords)
+                       ? Token::Kind::KEYWORD
+                       : Token::Kind::NAME;
+    } else if (IsDigit(c) ||
+               (c == '.' && code.size() > 1 && IsDigit(code[1]))) {
+      token = {Token::Kind::NUMBER, code.substr(0, Number(code))};
+    } else {
+      for (const absl::string_view symbol : kSymbols) {
+        if (absl::StartsWith(code, symbol)) {
+          token.text = symbol;
+          break;
+        }
+      }
+    }
+    tokens.push_back(token);
+    code.remove_prefix(token.text.size());
+  }
+  return tokens;
+}
+
+std::vector<absl::string_view> AssignedNames(const std::vector<Token> &tokens) {
+  std::vector<absl::string_view> names;
+  const bool function =
+      std::any_of(tokens.begin(), tokens.end(), [](const Token &token) {
+        return IsKeyword(token, "function");
+      });
+  if (function) {
+    for (const Token &token : tokens) {
+      if (token.kind == Token::Kind::NAME) {
+        names.push_back(token.text);
+      }
+    }
+    return names;
+  }
+  for (size_t i = 0; i < tokens.size(); ++i) {
+    if (IsKeyword(tokens[i], "local") || IsKeyword(tokens[i], "for")) {
+      // Declared names, separated by commas, with attributes like <const>.
+      for (size_t j = i + 1; j < tokens.size(); ++j) {
+        if (tokens[j].kind == Token::Kind::NAME) {
+          names.push_back(tokens[j].text);
+        } else if (!IsSymbol(tokens[j], ",") && !IsSymbol(tokens[j], "<") &&
+                   !IsSymbol(tokens[j], ">")) {
+          break;
+        }
+      }
+    } else if (IsSymbol(tokens[i], "=")) {
+      // Targets of the assignment: names, fields and indexes, separated by
+      // commas. Only names not following a "." or ":" are variables.
+      int depth = 0;
+      for (size_t j = i; j-- > 0;) {
+        const Token &token = tokens[j];
+        if (IsSymbol(token, "]") || IsSymbol(token, ")")) {
+          ++depth;
+        } else if (IsSymbol(token, "[") || IsSymbol(token, "(")) {
+          if (depth-- == 0) {
+            break;
+          }
+        } else if (depth > 0) {
+          continue;
+        } else if (token.kind == Token::Kind::NAME) {
+          if (tokens[j + 1].kind == Token::Kind::NAME) {
+            break; // Two names in a row: end of a previous statement.
+          }
+          if (j == 0 || (!IsSymbol(tokens[j - 1], ".") &&
+                         !IsSymbol(tokens[j - 1], ":"))) {
+            names.push_back(token.text);
+          }
+        } else if (!IsSymbol(token, ".") && !IsSymbol(token, ":") &&
+                   !IsSymbol(token, ",")) {
+          break;
+        }
+      }
+    }
+  }
+  return names;
+}
+
+int BlockDelta(const std::vector<Token> &tokens) {
+  int delta = 0;
+  for (const Token &token : tokens) {
+    if (IsKeyword(token, "if") || IsKeyword(token, "do") ||
+        IsKeyword(token, "function") || IsKeyword(token, "repeat")) {
+      ++delta;
+    } else if (IsKeyword(token, "end") || IsKeyword(token, "until")) {
+      --delta;
+    }
+  }
+  return delta;
+}
+
+} // namespace jude
+} // namespace xdk
@@ -0,0 +1,42 @@
+#ifndef XDK_JUDE_LEXER_H
+#define XDK_JUDE_LEXER_H
+
+#include <vector>
+
+#include "absl/strings/string_view.h"
+
+namespace xdk {
+namespace jude {
+
+// A token of Lua code. Its text points into the code it was read from.
+struct Token {
+  enum class Kind {
+    NAME = 0,
+    KEYWORD = 1,
+    NUMBER = 2,
+    STRING = 3,
+    SYMBOL = 4,
+  };
+  Kind kind;
+  absl::string_view text;
+};
+
+bool IsKeyword(const Token &token, absl::string_view text);
+
+// Splits Lua code into tokens, skipping whitespace and comments. This is not a
+// validating lexer: unfinished strings and comments extend to the end of code.
+std::vector<Token> Tokenize(absl::string_view code);
+
+// Returns the names that code may assign or declare: assignment targets,
+// local and loop variables. If code defines a function, whose body could
+// assign anything, returns all names of code. Names may be repeated.
+std::vector<absl::string_view> AssignedNames(const std::vector<Token> &tokens);
+
+// Returns by how much code changes the nesting of Lua blocks, e.g. 1 for
+// "for i=1,3 do" and -1 for "end".
+int BlockDelta(const std::vector<Token> &tokens);
+
+} // namespace jude
+} // namespace xdk
+
+#endif
@@ -0,0 +1,91 @@
+#include "xdk/jude/lexer.h"
+
+#include <string>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace xdk {
+namespace jude {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::IsEmpty;
+using ::testing::UnorderedElementsAre;
+
+std::vector<std::string> Texts(absl::string_view code) {
+  std::vector<std::string> texts;
+  for (const Token &token : Tokenize(code)) {
+    texts.emplace_back(token.text);
+  }
+  return texts;
+}
+
+std::vector<std::string> Assigned(absl::string_view code) {
+  std::vector<std::string> names;
+  for (absl::string_view name : AssignedNames(Tokenize(code))) {
+    names.emplace_back(name);
+  }
+  return names;
+}
+
+TEST(LexerTest, TokenizeWorks) {
+  EXPECT_THAT(Texts(""), IsEmpty());
+  EXPECT_THAT(Texts("x=a.b..'c'"),
+              ElementsAre("x", "=", "a", ".", "b", "..", "'c'"));
+  EXPECT_THAT(Texts("if x ~= 1.5e-3 then"),
+              ElementsAre("if", "x", "~=", "1.5e-3", "then"));
+}
+
+TEST(LexerTest, TokenizeSkipsComments) {
+  EXPECT_THAT(Texts("a -- comment\nb"), ElementsAre("a", "b"));
+  EXPECT_THAT(Texts("a --[==[ long\n]] comment ]==] b"), ElementsAre("a", "b"));
+}
+
+TEST(LexerTest, TokenizeKeepsStrings) {
+  EXPECT_THAT(Texts(R"(f("x = \" y", [==[ z ]] ]==]))"),
+              ElementsAre("f", "(", R"("x = \" y")", ",", "[==[ z ]] ]==]",
+                          ")"));
+  EXPECT_THAT(Texts("'unfinished"), ElementsAre("'unfinished"));
+}
+
+TEST(LexerTest, TokenizeFindsKeywords) {
+  const std::vector<Token> tokens = Tokenize("local x");
+  ASSERT_EQ(tokens.size(), 2u);
+  EXPECT_EQ(tokens[0].kind, Token::Kind::KEYWORD);
+  EXPECT_EQ(tokens[1].kind, Token::Kind::NAME);
+}
+
+TEST(LexerTest, AssignedNamesFindsTargets) {
+  EXPECT_THAT(Assigned("x = 1"), ElementsAre("x"));
+  EXPECT_THAT(Assigned("a.b, c[i] = 1, 2"), UnorderedElementsAre("a", "c"));
+  EXPECT_THAT(Assigned("local y x = y"), ElementsAre("y", "x", "x"));
+  EXPECT_THAT(Assigned("if x == 1 then"), IsEmpty());
+  EXPECT_THAT(Assigned("if flags.beta then"), IsEmpty());
+}
+
+TEST(LexerTest, AssignedNamesFindsDeclarations) {
+  EXPECT_THAT(Assigned("local a, b <const> = f()"),
+              UnorderedElementsAre("a", "b", "const"));
+  EXPECT_THAT(Assigned("for k, v in pairs(t) do"),
+              UnorderedElementsAre("k", "v"));
+  EXPECT_THAT(Assigned("for i = 1, n do"), UnorderedElementsAre("i", "i"));
+}
+
+TEST(LexerTest, AssignedNamesGivesAllNamesOfFunctions) {
+  EXPECT_THAT(Assigned("(function() x = y end)()"),
+              UnorderedElementsAre("x", "y"));
+}
+
+TEST(LexerTest, BlockDeltaWorks) {
+  EXPECT_EQ(BlockDelta(Tokenize("for i=1,3 do")), 1);
+  EXPECT_EQ(BlockDelta(Tokenize("if x then")), 1);
+  EXPECT_EQ(BlockDelta(Tokenize("elseif x then")), 0);
+  EXPECT_EQ(BlockDelta(Tokenize("end")), -1);
+  EXPECT_EQ(BlockDelta(Tokenize("f(function() end)")), 0);
+}
+
+} // namespace
+} // namespace jude
+} // namespace xdk
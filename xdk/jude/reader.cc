@@ -1,5 +1,6 @@
 #include "xdk/jude/reader.h"
 #include "absl/base/macros.h"
+#include <algorithm>
 #include "absl/strings/match.h"
 #include "absl/strings/strip.h"
 #include <iostream>
@@ -83,6 +84,48 @@ const char *Reader::Read(lua_State *L, void *data, size_t *size) noexcept {
   return reinterpret_cast<Reader *>(data)->Read(L, size);
 }
 
+bool Reader::Next(Segment *segment) {
+  const char *begin = source_.data();
+  size_t size;
+  if (Read(nullptr, &size) == nullptr) {
+    return false;
+  }
+  segment->code.clear();
+  segment->lines_before = std::count(begin, source_.data(), '\n');
+  const bool text = mode_ == Mode::TEXT;
+  switch (mode_) {
+  case Mode::BEGIN:
+    // Only a closing long string is produced without leaving BEGIN.
+    segment->kind = Segment::Kind::TEXT;
+    segment->code = "']]'";
+    break;
+  case Mode::TEXT:
+    segment->kind = Segment::Kind::TEXT;
+    segment->code = "[[\n";
+    break;
+  case Mode::EXPRESSION:
+    segment->kind = Segment::Kind::EXPRESSION;
+    break;
+  default:
+    segment->kind = Segment::Kind::STATEMENT;
+    break;
+  }
+  // Chunks are code until the one returning to BEGIN, which closes the _o
+  // call or the statement.
+  while (mode_ != Mode::BEGIN) {
+    const char *chunk = Read(nullptr, &size);
+    if (chunk == nullptr || mode_ == Mode::BEGIN) {
+      break;
+    }
+    segment->code.append(chunk, size);
+  }
+  if (text) {
+    segment->code.append("]]");
+  }
+  segment->lines = std::count(begin, source_.data(), '\n');
+  return true;
+}
+
 const char *Reader::Consume(size_t size) {
   const char *read = source_.data();
   source_.remove_prefix(size);
@@ -1,6 +1,8 @@
 #ifndef XDK_JUDE_READER_H
 #define XDK_JUDE_READER_H
 
+#include <string>
+
 #include "absl/strings/string_view.h"
 #include "xdk/lua/lua.hpp"
 
@@ -20,13 +22,40 @@ namespace jude {
 //
 // Caller can then lua_pcall the loaded chunks with whatever definition of the
 // _o function it wants, and setting up whatever environment it wants.
+//
+// Alternatively, Next() gives the program one segment at a time, for callers
+// that want to transform it.
 class Reader final {
 public:
+  // A piece of the program, without the code around it.
+  struct Segment {
+    enum class Kind {
+      TEXT = 0,
+      EXPRESSION = 1,
+      STATEMENT = 2,
+    };
+    Kind kind;
+    // The arguments of an _o call for TEXT and EXPRESSION, the Lua statement
+    // for STATEMENT.
+    std::string code;
+    // Number of newlines of the template consumed before code, like the one
+    // of a leading "\n{%-".
+    int lines_before = 0;
+    // Number of newlines of the template consumed by the segment, including
+    // those not in code, like the one of a trailing "-%}\n".
+    int lines = 0;
+  };
+
   // Data must stay valid as long as the reader is being used.
   Reader(const char *data, size_t size) noexcept;
 
   static const char *Read(lua_State *L, void *data, size_t *size) noexcept;
 
+  // Reads the next segment. Returns false at the end of the template. The
+  // program is the concatenation of _o(code) for TEXT and EXPRESSION segments
+  // and of " code " for STATEMENT segments. Must not be mixed with Read().
+  bool Next(Segment *segment);
+
 private:
   enum class Mode {
     BEGIN = 0,
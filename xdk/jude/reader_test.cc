@@ -7,6 +7,7 @@
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include <string>
+#include <vector>
 
 namespace xdk {
 namespace jude {
@@ -21,6 +22,21 @@ protected:
     return lua::Read(Reader::Read, L, &reader);
   }
 
+  // Returns the program built from the segments of Reader::Next().
+  std::string ReadSegments(absl::string_view source) {
+    Reader reader(source.data(), source.size());
+    std::string program;
+    Reader::Segment segment;
+    while (reader.Next(&segment)) {
+      if (segment.kind == Reader::Segment::Kind::STATEMENT) {
+        absl::StrAppend(&program, " ", segment.code, " ");
+      } else {
+        absl::StrAppend(&program, "_o(", segment.code, ")");
+      }
+    }
+    return program;
+  }
+
   xdk::lua::State L;
 };
 
@@ -171,6 +187,45 @@ TEST_F(ReaderTest, LinesEndingWithExpressionWork) {
     other line.]]))");
 }
 
+TEST_F(ReaderTest, SegmentsGiveSameProgram) {
+  for (const char *source : {
+           "",
+           "x",
+           "some {{3+4}} expression",
+           R"({{with "string \" }}\\" expression}})",
+           "some {%3+4%} statement",
+           "{%--%}",
+           "\n  {%- x=2 -%}\n  third line",
+           "unfinished {{expression",
+           "some [[text]] in double brackets",
+           "{{ [[text]] }}{% x=[[text]] %}",
+       }) {
+    EXPECT_EQ(ReadSegments(source), Read(source)) << source;
+  }
+}
+
+TEST_F(ReaderTest, SegmentsCountConsumedNewlines) {
+  const std::string source = "a\n{%- x=1 -%}\nb\n{{\nx\n}}";
+  Reader reader(source.data(), source.size());
+  std::vector<Reader::Segment> segments;
+  for (Reader::Segment segment; reader.Next(&segment);) {
+    segments.push_back(segment);
+  }
+  ASSERT_EQ(segments.size(), 4u);
+  EXPECT_EQ(segments[0].kind, Reader::Segment::Kind::TEXT);
+  EXPECT_EQ(segments[0].code, "[[\na]]");
+  EXPECT_EQ(segments[0].lines, 0);
+  EXPECT_EQ(segments[1].kind, Reader::Segment::Kind::STATEMENT);
+  EXPECT_EQ(segments[1].code, " x=1 ");
+  EXPECT_EQ(segments[1].lines_before, 1);
+  EXPECT_EQ(segments[1].lines, 2);
+  EXPECT_EQ(segments[2].code, "[[\nb\n]]");
+  EXPECT_EQ(segments[2].lines, 1);
+  EXPECT_EQ(segments[3].kind, Reader::Segment::Kind::EXPRESSION);
+  EXPECT_EQ(segments[3].code, "\nx\n");
+  EXPECT_EQ(segments[3].lines, 2);
+}
+
 } // namespace
 } // namespace jude
 } // namespace xdk